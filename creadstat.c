@@ -20,6 +20,8 @@
 #include "kno/storage.h"
 #include "kno/texttools.h"
 #include "kno/cprims.h"
+#include "kno/bufio.h"
+#include "kno/dtypeio.h"
 
 #include "kno/sql.h"
 
@@ -29,9 +31,17 @@
 #include <libu8/u8crypto.h>
 
 #include <math.h>
+#include <ctype.h>
 #include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <readstat.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* Compatability */
 
 #if (KNO_MAJOR_VERSION < 2210)
@@ -50,7 +60,6 @@
    * Merge callback and output, include futures as output.
    * Add handling for missing and labelled values
    * Handle ctime/mtime metadata
-   * Use encoding when provided (do we have to?)
    * Add measure and alignment to schema
  */
 
@@ -61,6 +70,18 @@ kno_lisp_type kno_readstat_type;
 
 static lispval creadstat_module;
 
+typedef struct KNO_READSTAT_ENTRY {
+  unsigned int rse_hash;
+  lispval rse_key;
+  lispval rse_observation;} *kno_readstat_entry;
+
+typedef struct KNO_READSTAT_INDEX {
+  lispval rsx_slotid;
+  int rsx_slotno;
+  size_t rsx_n_buckets;
+  size_t rsx_n_entries;
+  struct KNO_READSTAT_ENTRY *rsx_entries;} *kno_readstat_index;
+
 typedef struct KNO_READSTAT {
   KNO_ANNOTATED_HEADER;
   u8_string rs_source;
@@ -70,6 +91,7 @@ typedef struct KNO_READSTAT {
   int rs_n_slots;
   readstat_parser_t *rs_parser;
   u8_encoding rs_text_encoding;
+  struct U8_OUTPUT rs_textbuf;
   lispval rs_idslot;
   lispval rs_vlabels;
   struct KNO_SCHEMAP *rs_dataframe;
@@ -77,9 +99,38 @@ typedef struct KNO_READSTAT {
   struct KNO_SCHEMAP *rs_observation;
   lispval *rs_values;
   lispval rs_output;
+  lispval rs_shards;
+  int rs_n_shards;
+  lispval rs_shardkey;
+  int rs_shardslot;
+  long long rs_row_offset;
+  long long rs_last_row;
+  unsigned long long rs_schema_hash;
+  unsigned long long rs_last_hash;
+  unsigned long long rs_since_schema;
+  unsigned long long rs_since_row;
+  int rs_n_indexes;
+  struct KNO_READSTAT_INDEX *rs_indexes;
+  struct KNO_READSTAT_SORT *rs_sort;
+  lispval *rs_scratch;
+  int *rs_present;
+  struct KNO_KEYVAL *rs_keyvals;
+  int rs_n_present;
+  double rs_sparse_threshold;
+  long long rs_cells_present;
+  long long rs_cells_total;
+  int rs_dates;
+  unsigned char *rs_datekinds;
   int rs_counter;} *kno_readstat;
 
 #define KNO_READSTAT_FOLDCASE 0x100
+#define KNO_READSTAT_RESUMING 0x200
+#define KNO_READSTAT_STALE    0x400
+#define KNO_READSTAT_FAILED   0x800
+#define KNO_READSTAT_SPARSE   0x1000
+#define KNO_READSTAT_DENSE    0x2000
+
+#define READSTAT_HASH_INIT 0xcbf29ce484222325ULL
 
 DEF_KNOSYM(nvars); DEF_KNOSYM(rows); DEF_KNOSYM(label); DEF_KNOSYM(tablename);
 DEF_KNOSYM(encname); DEF_KNOSYM(is64bit); DEF_KNOSYM(idslot);
@@ -96,6 +147,12 @@ DEF_KNOSYM(string); DEF_KNOSYM(stringref);
 DEF_KNOSYM(int8); DEF_KNOSYM(int16); DEF_KNOSYM(int32);
 DEF_KNOSYM(float); DEF_KNOSYM(double);
 DEF_KNOSYM(slotid); DEF_KNOSYM(output); DEF_KNOSYM(foldcase);
+DEF_KNOSYM(shards); DEF_KNOSYM(shardkey);
+DEF_KNOSYM(since); DEF_KNOSYM(schema); DEF_KNOSYM(lastrow);
+DEF_KNOSYM(source); DEF_KNOSYM(resumed); DEF_KNOSYM(index);
+DEF_KNOSYM(sortby); DEF_KNOSYM(sortmem); DEF_KNOSYM(sortdir); DEF_KNOSYM(sparse);
+DEF_KNOSYM(dates); DEF_KNOSYM(epoch); DEF_KNOSYM(timeunit);
+DEF_KNOSYM(days); DEF_KNOSYM(seconds); DEF_KNOSYM(milliseconds);
 
 static lispval system_missing_value;
 static lispval tagged_missing_values[26];
@@ -107,6 +164,90 @@ static void store_string(lispval table,lispval slotid,u8_string value)
   kno_decref(string);
 }
 
+/* Text conversion */
+
+/* Strings from ReadStat are usually ASCII, and ReadStat converts many
+   files to UTF-8 itself, so we only transcode strings which aren't
+   already valid UTF-8. */
+
+static const unsigned char *skip_ascii(const unsigned char *scan,
+				       const unsigned char *limit)
+{
+#if defined(__SSE2__)
+  while ((scan+16)<=limit) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)scan);
+    int mask = _mm_movemask_epi8(chunk);
+    if (mask) return scan+__builtin_ctz(mask);
+    scan += 16;}
+#endif
+  while ((scan+8)<=limit) {
+    unsigned long long word;
+    memcpy(&word,scan,8);
+    if (word&0x8080808080808080ULL) break;
+    scan += 8;}
+  while ( (scan<limit) && (*scan < 0x80) ) scan++;
+  return scan;
+}
+
+static int valid_utf8p(const unsigned char *scan,const unsigned char *limit)
+{
+  while ((scan = skip_ascii(scan,limit)) < limit) {
+    unsigned char c = *scan;
+    int n_bytes; unsigned int min;
+    if ((c&0xE0)==0xC0) { n_bytes = 1; min = 0x80; }
+    else if ((c&0xF0)==0xE0) { n_bytes = 2; min = 0x800; }
+    else if ((c&0xF8)==0xF0) { n_bytes = 3; min = 0x10000; }
+    else return 0;
+    if ((scan+n_bytes)>=limit) return 0;
+    unsigned int code = c & (0x3F>>n_bytes);
+    int i = 1; while (i<=n_bytes) {
+      if ((scan[i]&0xC0)!=0x80) return 0;
+      code = (code<<6)|(scan[i]&0x3F);
+      i++;}
+    if ( (code<min) || (code>0x10FFFF) ||
+	 ( (code>=0xD800) && (code<0xE000) ) )
+      return 0;
+    scan += n_bytes+1;}
+  return 1;
+}
+
+static lispval readstat_text(kno_readstat rs,const char *text)
+{
+  if (text == NULL) return knostring("");
+  const unsigned char *start = (const unsigned char *) text;
+  size_t len = strlen(text);
+  const unsigned char *limit = start+len;
+  const unsigned char *scan = skip_ascii(start,limit);
+  if ( (scan == limit) || (valid_utf8p(scan,limit)) )
+    return kno_make_string(NULL,len,text);
+  struct U8_OUTPUT tmpbuf, *out;
+  if (rs) {
+    out = &(rs->rs_textbuf);
+    out->u8_write = out->u8_outbuf;
+    out->u8_outbuf[0] = '\0';}
+  else {
+    U8_INIT_OUTPUT(&tmpbuf,len*2+1);
+    out = &tmpbuf;}
+  u8_putn(out,text,scan-start);
+  if ( (rs) && (rs->rs_text_encoding) )
+    u8_convert(rs->rs_text_encoding,0,out,&scan,limit);
+  else while (scan<limit) {
+      /* Without a declared encoding, assume Latin-1 */
+      u8_putc(out,*scan++);}
+  lispval result =
+    kno_make_string(NULL,out->u8_write-out->u8_outbuf,out->u8_outbuf);
+  if (out == &tmpbuf) u8_close_output(&tmpbuf);
+  return result;
+}
+
+static void store_text(kno_readstat rs,lispval table,lispval slotid,
+		       const char *value)
+{
+  lispval string = readstat_text(rs,value);
+  kno_store(table,slotid,string);
+  kno_decref(string);
+}
+
 static u8_context get_readstat_typename(readstat_type_t type)
 {
   switch (type) {
@@ -174,7 +315,7 @@ static u8_string get_valstring(readstat_value_t *val)
   }
 }
 
-static lispval get_lisp_value(readstat_value_t *val)
+static lispval get_lisp_value(kno_readstat rs,readstat_value_t *val)
 {
   if (val->is_system_missing)
     return system_missing_value;
@@ -184,7 +325,7 @@ static lispval get_lisp_value(readstat_value_t *val)
   readstat_type_t valtype = val->type;
   switch (valtype) {
   case READSTAT_TYPE_STRING:
-    return knostring(val->v.string_value);
+    return readstat_text(rs,val->v.string_value);
   case READSTAT_TYPE_INT8:
     return KNO_INT(val->v.i8_value);
   case READSTAT_TYPE_INT16:
@@ -196,12 +337,235 @@ static lispval get_lisp_value(readstat_value_t *val)
   case READSTAT_TYPE_DOUBLE:
     return kno_make_flonum(val->v.double_value);
   case READSTAT_TYPE_STRING_REF:
-    return knostring(val->v.string_value);
+    return readstat_text(rs,val->v.string_value);
   default:
     return KNO_VOID;
   }
 }
 
+/* Dates and times */
+
+/* With the `dates` option, numeric variables whose display format is
+   a date or datetime format are converted while parsing, either to
+   timestamps or (with `dates=epoch`) to integer Unix seconds, or Unix
+   milliseconds for Stata's millisecond datetimes. The epoch and unit
+   depend on the file type: SAS and Stata count from 1960-01-01 and
+   SPSS counts seconds from 1582-10-14. Stata's %tC format counts leap
+   seconds, which Unix time doesn't, so %tC variables are left as
+   numbers. */
+
+#define READSTAT_DATES_TIMESTAMP 1
+#define READSTAT_DATES_EPOCH     2
+
+#define DATEKIND_NONE         0
+#define DATEKIND_SAS_DAYS     1
+#define DATEKIND_SAS_SECONDS  2
+#define DATEKIND_STATA_MS     3
+#define DATEKIND_SPSS_SECONDS 4
+
+/* Unix time of each epoch and seconds per unit, indexed by datekind */
+static const double datekind_epochs[] =
+  { 0, -315619200.0, -315619200.0, -315619200.0, -12219379200.0 };
+static const double datekind_units[] =
+  { 1, 86400.0, 1.0, 0.001, 1.0 };
+
+static const char *sas_date_formats[] =
+  { "DATE", "DAY", "DDMMYY", "MMDDYY", "YYMMDD", "MONYY", "YYMON", "MMYY",
+    "YYMM", "YYQ", "WEEKDATE", "WEEKDATX", "WORDDATE", "WORDDATX",
+    "JULIAN", "E8601DA", "B8601DA", "NLDATE", "MINGUO", NULL };
+static const char *sas_datetime_formats[] =
+  { "DATETIME", "DATEAMPM", "E8601DT", "B8601DT", "MDYAMPM", "NLDATM",
+    NULL };
+static const char *spss_date_formats[] =
+  { "DATE", "ADATE", "EDATE", "JDATE", "SDATE", "QYR", "MOYR", "WKYR",
+    "DATETIME", "YMDHMS", NULL };
+
+/* This matches *name* against a list of format names, where a list
+   entry also matches names with a trailing letter variant, e.g.
+   DDMMYYS or YYMMDDN */
+static int match_format(const char *name,const char **formats)
+{
+  const char **scan = formats;
+  while (*scan) {
+    size_t len = strlen(*scan);
+    if ( (strncmp(name,*scan,len) == 0) &&
+	 ( (name[len] == '\0') ||
+	   ( (name[len+1] == '\0') && (strlen(*scan) >= 6) ) ) )
+      return 1;
+    else scan++;}
+  return 0;
+}
+
+static int classify_date_format(u8_context filetype,const char *format)
+{
+  if ( (format == NULL) || (format[0] == '\0') )
+    return DATEKIND_NONE;
+  else if (format[0] == '%') {
+    /* Stata: %td, %tc, or the old %d, with optional modifiers */
+    const char *scan = format+1;
+    if (*scan == '-') scan++;
+    if ( (scan[0] == 't') && (scan[1] == 'c') )
+      return DATEKIND_STATA_MS;
+    else if ( (scan[0] == 't') && (scan[1] == 'd') )
+      return DATEKIND_SAS_DAYS;
+    else if (scan[0] == 'd')
+      return DATEKIND_SAS_DAYS;
+    else return DATEKIND_NONE;}
+  /* Copy the name without its width and decimals, e.g. DATE9. */
+  char name[32];
+  size_t len = strlen(format);
+  while ( (len>0) &&
+	  ( (isdigit(format[len-1])) || (format[len-1] == '.') ) )
+    len--;
+  if ( (len == 0) || (len >= sizeof(name)) ) return DATEKIND_NONE;
+  int i = 0; while (i<len) { name[i] = toupper(format[i]); i++; }
+  name[len] = '\0';
+  if ( (strcmp(filetype,"sav") == 0) || (strcmp(filetype,"por") == 0) )
+    return (match_format(name,spss_date_formats)) ?
+      (DATEKIND_SPSS_SECONDS) : (DATEKIND_NONE);
+  else if (match_format(name,sas_datetime_formats))
+    return DATEKIND_SAS_SECONDS;
+  else if (match_format(name,sas_date_formats))
+    return DATEKIND_SAS_DAYS;
+  else return DATEKIND_NONE;
+}
+
+static lispval get_datekind_unit(int kind)
+{
+  switch (kind) {
+  case DATEKIND_SAS_DAYS:
+    return KNOSYM(days);
+  case DATEKIND_STATA_MS:
+    return KNOSYM(milliseconds);
+  default:
+    return KNOSYM(seconds);
+  }
+}
+
+static lispval convert_date_value(kno_readstat rs,int kind,
+				  readstat_value_t *val)
+{
+  double x;
+  switch (val->type) {
+  case READSTAT_TYPE_INT8:
+    x = val->v.i8_value; break;
+  case READSTAT_TYPE_INT16:
+    x = val->v.i16_value; break;
+  case READSTAT_TYPE_INT32:
+    x = val->v.i32_value; break;
+  case READSTAT_TYPE_FLOAT:
+    x = val->v.float_value; break;
+  case READSTAT_TYPE_DOUBLE:
+    x = val->v.double_value; break;
+  default:
+    return get_lisp_value(rs,val);
+  }
+  if (isnan(x)) return get_lisp_value(rs,val);
+  long long secs = (long long) datekind_epochs[kind];
+  long long nsecs;
+  u8_tmprec prec;
+  if (kind == DATEKIND_STATA_MS) {
+    /* Work in whole milliseconds, which is Stata's precision */
+    long long ms = llround(x), rem = ms%1000;
+    if (rem<0) rem += 1000;
+    secs += (ms-rem)/1000;
+    if (rs->rs_dates == READSTAT_DATES_EPOCH)
+      return KNO_INT((secs*1000)+rem);
+    nsecs = rem*1000000;
+    prec = u8_millisecond;}
+  else {
+    /* Split off the fraction before adding the epoch, so that it isn't
+       lost to the size of the Unix time */
+    double since = x*datekind_units[kind], whole = floor(since);
+    long long usecs = llround((since-whole)*1000000.0);
+    secs += (long long) whole;
+    if (usecs >= 1000000) { secs++; usecs -= 1000000; }
+    if (rs->rs_dates == READSTAT_DATES_EPOCH)
+      return KNO_INT(secs);
+    nsecs = usecs*1000;
+    prec = (usecs) ? (u8_microsecond) : (u8_second);}
+  struct U8_XTIME xt;
+  u8_init_xtime(&xt,(time_t)secs,prec,nsecs,0,0);
+  return kno_make_timestamp(&xt);
+}
+
+/* This is FNV-1a, used for schema fingerprints, row hashes, and shard keys */
+static unsigned long long hash_bytes(unsigned long long h,
+				     const void *bytes,size_t len)
+{
+  const unsigned char *scan = bytes, *limit = scan+len;
+  while (scan<limit) { h ^= *scan++; h *= 0x100000001b3ULL; }
+  return h;
+}
+
+static unsigned long long hash_string(unsigned long long h,const char *s)
+{
+  if (s) return hash_bytes(h,s,strlen(s)+1);
+  else return hash_bytes(h,"",1);
+}
+
+static unsigned long long hash_cell(unsigned long long h,lispval v)
+{
+  unsigned char tag;
+  if (KNO_FIXNUMP(v)) {
+    long long ival = KNO_FIX2INT(v); tag = 'i';
+    h = hash_bytes(h,&tag,1);
+    return hash_bytes(h,&ival,sizeof(ival));}
+  else if (KNO_FLONUMP(v)) {
+    double dval = KNO_FLONUM(v); tag = 'd';
+    h = hash_bytes(h,&tag,1);
+    return hash_bytes(h,&dval,sizeof(dval));}
+  else if (KNO_STRINGP(v)) {
+    tag = 's';
+    h = hash_bytes(h,&tag,1);
+    return hash_bytes(h,KNO_CSTRING(v),KNO_STRLEN(v)+1);}
+  else if (KNO_TYPEP(v,kno_timestamp_type)) {
+    time_t tick = ((kno_timestamp)v)->u8xtimeval.u8_tick; tag = 't';
+    unsigned int nsecs = ((kno_timestamp)v)->u8xtimeval.u8_nsecs;
+    h = hash_bytes(h,&tag,1);
+    h = hash_bytes(h,&tick,sizeof(tick));
+    return hash_bytes(h,&nsecs,sizeof(nsecs));}
+  else if (KNO_CONSTANTP(v)) {
+    int i = 0; while (i<26) {
+      if (v == tagged_missing_values[i]) break;
+      else i++;}
+    tag = 'a'+i;
+    return hash_bytes(h,&tag,1);}
+  else {
+    unsigned int code = kno_hash_lisp(v); tag = 'x';
+    h = hash_bytes(h,&tag,1);
+    return hash_bytes(h,&code,sizeof(code));}
+}
+
+/* This hashes the variable cells (not the idslot) of the pending row,
+   skipping missing cells so that dense and sparse rows hash the same.
+   It's only used for the rows recorded in and checked against
+   checkpoints. */
+static unsigned long long hash_row(kno_readstat rs)
+{
+  unsigned long long h = READSTAT_HASH_INIT;
+  int n_vars = rs->rs_n_vars;
+  if ((rs->rs_bits)&(KNO_READSTAT_SPARSE)) {
+    int i = 0, n = rs->rs_n_present;
+    while (i<n) {
+      int slotno = rs->rs_present[i++];
+      if (slotno >= n_vars) continue;
+      h = hash_bytes(h,&slotno,sizeof(slotno));
+      h = hash_cell(h,rs->rs_scratch[slotno]);}}
+  else {
+    lispval *values = rs->rs_values;
+    int i = 0; while (i<n_vars) {
+      lispval v = values[i];
+      if ( (KNO_VOIDP(v)) || (v == system_missing_value) ) {
+	i++; continue;}
+      h = hash_bytes(h,&i,sizeof(i));
+      h = hash_cell(h,v);
+      i++;}}
+  return h;
+}
+
+static void grow_index(struct KNO_READSTAT_INDEX *ix,size_t n_buckets);
+
 #define KNO_DATAFRAME_TEMPLATE_FLAGS \
   (KNO_SCHEMAP_FIXED_SCHEMA|KNO_SCHEMAP_DATAFRAME)
 
@@ -223,6 +587,20 @@ static int metadata_handler(readstat_metadata_t *md,void *state)
   rs->rs_dataframe = template;
   rs->rs_n_vars    = n_vars;
   rs->rs_n_slots   = n_slots;
+  rs->rs_schema_hash = hash_bytes(READSTAT_HASH_INIT,&n_vars,sizeof(n_vars));
+  if (rs->rs_dates) {
+    if (rs->rs_datekinds) u8_free(rs->rs_datekinds);
+    rs->rs_datekinds = u8_alloc_n(n_vars,unsigned char);
+    memset(rs->rs_datekinds,DATEKIND_NONE,n_vars);}
+  if ((rs->rs_bits)&(KNO_READSTAT_SPARSE)) {
+    if (rs->rs_scratch) u8_free(rs->rs_scratch);
+    if (rs->rs_present) u8_free(rs->rs_present);
+    if (rs->rs_keyvals) u8_free(rs->rs_keyvals);
+    rs->rs_scratch = u8_alloc_n(n_slots,lispval);
+    rs->rs_present = u8_alloc_n(n_slots,int);
+    rs->rs_keyvals = u8_alloc_n(n_slots,struct KNO_KEYVAL);
+    rs->rs_n_present = 0;
+    i = 0; while (i<n_slots) rs->rs_scratch[i++] = KNO_VOID;}
   lispval annotations = rs->annotations;
   if (md->creation_time>0)  {
     lispval timestamp = kno_time2timestamp(md->creation_time);
@@ -238,14 +616,24 @@ static int metadata_handler(readstat_metadata_t *md,void *state)
   if (md->var_count>=0) {
     kno_store(annotations,KNOSYM(nvars),KNO_INT(md->var_count));}
   if (md->row_count>=0) {
-    kno_store(annotations,KNOSYM(rows),KNO_INT(md->row_count));}
-  if (md->table_name)
-    store_string(annotations,KNOSYM(tablename),md->table_name);
-  if (md->file_label)
-    store_string(annotations,KNOSYM(label),md->file_label);
+    kno_store(annotations,KNOSYM(rows),KNO_INT(md->row_count));
+    /* Presize indexes so that every row fits under the 70% load
+       at which index_observation() would grow them */
+    size_t n_rows = md->row_count;
+    int ixno = 0; while (ixno<rs->rs_n_indexes) {
+      struct KNO_READSTAT_INDEX *ix = &(rs->rs_indexes[ixno++]);
+      size_t n_buckets = ix->rsx_n_buckets;
+      while ((n_buckets*7) <= (n_rows*10)) n_buckets = n_buckets*2;
+      if (n_buckets > ix->rsx_n_buckets) grow_index(ix,n_buckets);}}
   if (md->file_encoding) {
     store_string(annotations,KNOSYM(encname),md->file_encoding);
-    rs->rs_text_encoding=u8_get_encoding(md->file_encoding);}
+    if ( (strcasecmp(md->file_encoding,"UTF-8")) &&
+	 (strcasecmp(md->file_encoding,"UTF8")) )
+      rs->rs_text_encoding=u8_get_encoding(md->file_encoding);}
+  if (md->table_name)
+    store_text(rs,annotations,KNOSYM(tablename),md->table_name);
+  if (md->file_label)
+    store_text(rs,annotations,KNOSYM(label),md->file_label);
   switch (md->compression) {
   case READSTAT_COMPRESS_ROWS:
     kno_store(annotations,KNOSYM(compression),KNOSYM(rows));
@@ -293,9 +681,16 @@ static int variable_handler(int ix,readstat_variable_t *vd,
   schema[i]=slotid;
   values[i]=slot_info;
   kno_store(slot_info,KNOSYM(slotid),slotid);
+  unsigned long long fingerprint = rs->rs_schema_hash;
+  unsigned char vtype = vd->type;
+  fingerprint = hash_bytes(fingerprint,&i,sizeof(i));
+  fingerprint = hash_bytes(fingerprint,&vtype,1);
+  fingerprint = hash_string(fingerprint,vd->name);
+  fingerprint = hash_string(fingerprint,vd->format);
+  rs->rs_schema_hash = fingerprint;
   store_string(slot_info,KNOSYM(name),vd->name);
   store_string(slot_info,KNOSYM(format),vd->format);
-  store_string(slot_info,KNOSYM(label),vd->label);
+  store_text(rs,slot_info,KNOSYM(label),vd->label);
   COPY_INT_PROP(vd,offset);
   COPY_INT_PROP(vd,storage_width);
   COPY_INT_PROP(vd,user_width);
@@ -309,7 +704,7 @@ static int variable_handler(int ix,readstat_variable_t *vd,
     int n = vd->missingness.missing_ranges_count;
     lispval vec = kno_make_vector(n,NULL);
     int i = 0; while (i<n) {
-      lispval v = get_lisp_value(&(vd->missingness.missing_ranges[i]));
+      lispval v = get_lisp_value(rs,&(vd->missingness.missing_ranges[i]));
       KNO_VECTOR_SET(vec,i,v);
       i++;}
     kno_store(slot_info,KNOSYM(missing_ranges),vec);
@@ -337,6 +732,12 @@ static int variable_handler(int ix,readstat_variable_t *vd,
     break;
   }
   kno_store(slot_info,KNOSYM_TYPE,get_readstat_typesym(vd->type));
+  if ( (rs->rs_datekinds) && (i < rs->rs_n_vars) &&
+       (vd->type != READSTAT_TYPE_STRING) &&
+       (vd->type != READSTAT_TYPE_STRING_REF) ) {
+    int kind = classify_date_format(rs->rs_type,vd->format);
+    rs->rs_datekinds[i] = kind;
+    if (kind) kno_store(slot_info,KNOSYM(timeunit),get_datekind_unit(kind));}
   return READSTAT_HANDLER_OK;
 }
 
@@ -361,7 +762,7 @@ static int label_handler(const char *labelset,
 			 void *state)
 {
   struct KNO_READSTAT *rs = (kno_readstat) state;
-  lispval v = get_lisp_value(&value);
+  lispval v = get_lisp_value(rs,&value);
   add_value_label(rs,labelset,label,v);
   kno_decref(v);
   return READSTAT_HANDLER_OK;
@@ -369,7 +770,7 @@ static int label_handler(const char *labelset,
 
 static int log_label_handler(char *labelset,readstat_value_t value,char *label,void *ignored)
 {
-  lispval v = get_lisp_value(&value);
+  lispval v = get_lisp_value(NULL,&value);
   u8_log(LOGWARN,"ReadStatLabel","Label in %s maps %q to %s",labelset,v,label);
   kno_decref(v);
   return READSTAT_HANDLER_OK;
@@ -377,10 +778,10 @@ static int log_label_handler(char *labelset,readstat_value_t value,char *label,v
 
 /* Getting data */
 
-static void output_observation
-(kno_readstat rs,lispval observation,int obsid)
+static void sink_observation
+(kno_readstat rs,lispval *sinkp,lispval observation,int obsid)
 {
-  lispval output=rs->rs_output;
+  lispval output=*sinkp;
   if (KNO_PROCP(output)) {
     lispval args[3]={observation,KNO_INT(obsid),((lispval)rs)};
     int arity = ((kno_proc)output)->fcn_arity;
@@ -413,17 +814,950 @@ static void output_observation
     kno_change_future((kno_future)output,observation,KNO_FUTURE_MONOTONIC);
     kno_decref(observation);}
   else if ( (KNO_PAIRP(output)) || (output == KNO_EMPTY_LIST) )
-    rs->rs_output = kno_init_pair(NULL,observation,output);
+    *sinkp = kno_init_pair(NULL,observation,output);
+  else NO_ELSE;
+}
+
+/* Keys */
+
+/* This hashes the raw value of a shard or index key. Fixnums, flonums,
+   and strings (the usual id types) are hashed directly; anything else
+   goes through the generic Kno hash function. Integral flonums hash
+   like fixnums, since numeric ids are often stored as doubles. */
+static unsigned int hash_key(lispval key)
+{
+  unsigned long long h;
+  if (KNO_FIXNUMP(key))
+    h = (unsigned long long) KNO_FIX2INT(key);
+  else if (KNO_FLONUMP(key)) {
+    double d = KNO_FLONUM(key);
+    if ( (d == floor(d)) && (fabs(d) < 1e18) )
+      h = (unsigned long long) ((long long)d);
+    else memcpy(&h,&d,sizeof(h));}
+  else if (KNO_STRINGP(key))
+    h = hash_bytes(READSTAT_HASH_INIT,KNO_CSTRING(key),KNO_STRLEN(key));
+  else return kno_hash_lisp(key);
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (unsigned int) h;
+}
+
+static int keys_equalp(lispval key,lispval probe)
+{
+  if (key == probe)
+    return 1;
+  else if ( ( (KNO_FIXNUMP(key)) || (KNO_FLONUMP(key)) ) &&
+	    ( (KNO_FIXNUMP(probe)) || (KNO_FLONUMP(probe)) ) ) {
+    double kv = (KNO_FIXNUMP(key)) ? (KNO_FIX2INT(key)) : (KNO_FLONUM(key));
+    double pv = (KNO_FIXNUMP(probe)) ? (KNO_FIX2INT(probe)) :
+      (KNO_FLONUM(probe));
+    return (kv == pv);}
+  else return kno_equalp(key,probe);
+}
+
+static int get_slotno(kno_readstat rs,lispval slotid)
+{
+  struct KNO_SCHEMAP *df = rs->rs_dataframe;
+  if (df == NULL) return -1;
+  lispval *schema = df->table_schema;
+  int i = 0, n = df->schema_length;
+  while (i<n) {
+    if (schema[i] == slotid) return i;
+    else i++;}
+  return -1;
+}
+
+/* This returns a new reference to a key value from an observation,
+   which may be a dataframe schemap or (in sparse mode) a slotmap. */
+static lispval get_observation_key(lispval observation,int slotno,
+				   lispval slotid)
+{
+  if (KNO_SCHEMAPP(observation))
+    return kno_incref(((kno_schemap)observation)->table_values[slotno]);
+  else return kno_get(observation,slotid,KNO_VOID);
+}
+
+/* Sharding */
+
+static lispval get_shard_key(kno_readstat rs,lispval observation,int obsid)
+{
+  if (rs->rs_shardslot == -1) {
+    lispval shardkey = rs->rs_shardkey;
+    int slotno = ( (KNO_VOIDP(shardkey)) || (KNO_FALSEP(shardkey)) ) ? (-2) :
+      (get_slotno(rs,shardkey));
+    if (slotno == -2)
+      /* Without a shard key or idslot, just shard by row */
+      rs->rs_shardslot = -2;
+    else if (slotno<0) {
+      u8_log(LOGWARN,"ReadStatShardKey",
+	     "The shard key %q isn't a variable of %s, sharding by row",
+	     rs->rs_shardkey,rs->rs_source);
+      rs->rs_shardslot = -2;}
+    else rs->rs_shardslot = slotno;}
+  if (rs->rs_shardslot<0)
+    return KNO_INT(obsid);
+  else return get_observation_key
+	 (observation,rs->rs_shardslot,rs->rs_shardkey);
+}
+
+/* Indexing */
+
+/* Indexes are open-addressing hash tables with linear probing. Rows
+   with the same key get separate entries in the same probe run, and
+   entries hold references to the observations themselves. */
+
+static void init_index(struct KNO_READSTAT_INDEX *ix,lispval slotid,
+		       size_t n_buckets)
+{
+  ix->rsx_slotid = slotid;
+  ix->rsx_slotno = -1;
+  ix->rsx_n_buckets = n_buckets;
+  ix->rsx_n_entries = 0;
+  ix->rsx_entries = u8_alloc_n(n_buckets,struct KNO_READSTAT_ENTRY);
+  memset(ix->rsx_entries,0,sizeof(struct KNO_READSTAT_ENTRY)*n_buckets);
+}
+
+static void grow_index(struct KNO_READSTAT_INDEX *ix,size_t n_buckets)
+{
+  struct KNO_READSTAT_ENTRY *old = ix->rsx_entries;
+  size_t i = 0, n_old = ix->rsx_n_buckets, mask = n_buckets-1;
+  struct KNO_READSTAT_ENTRY *entries =
+    u8_alloc_n(n_buckets,struct KNO_READSTAT_ENTRY);
+  memset(entries,0,sizeof(struct KNO_READSTAT_ENTRY)*n_buckets);
+  while (i<n_old) {
+    if (old[i].rse_observation) {
+      size_t probe = old[i].rse_hash&mask;
+      while (entries[probe].rse_observation) probe = (probe+1)&mask;
+      entries[probe] = old[i];}
+    i++;}
+  u8_free(old);
+  ix->rsx_entries = entries;
+  ix->rsx_n_buckets = n_buckets;
+}
+
+static void index_observation(kno_readstat rs,lispval observation)
+{
+  int i = 0, n = rs->rs_n_indexes;
+  while (i<n) {
+    struct KNO_READSTAT_INDEX *ix = &(rs->rs_indexes[i++]);
+    if (ix->rsx_slotno == -1) {
+      int slotno = get_slotno(rs,ix->rsx_slotid);
+      if (slotno<0)
+	u8_log(LOGWARN,"ReadStatIndexKey",
+	       "The index key %q isn't a variable of %s",
+	       ix->rsx_slotid,rs->rs_source);
+      ix->rsx_slotno = (slotno<0) ? (-2) : (slotno);}
+    if (ix->rsx_slotno<0) continue;
+    lispval key =
+      get_observation_key(observation,ix->rsx_slotno,ix->rsx_slotid);
+    /* Don't index missing values */
+    if (KNO_CONSTANTP(key)) continue;
+    if ((ix->rsx_n_entries*10) >= (ix->rsx_n_buckets*7))
+      grow_index(ix,ix->rsx_n_buckets*2);
+    unsigned int hash = hash_key(key);
+    size_t mask = ix->rsx_n_buckets-1, probe = hash&mask;
+    struct KNO_READSTAT_ENTRY *entries = ix->rsx_entries;
+    while (entries[probe].rse_observation) probe = (probe+1)&mask;
+    entries[probe].rse_hash = hash;
+    entries[probe].rse_key = key;
+    entries[probe].rse_observation = kno_incref(observation);
+    ix->rsx_n_entries++;}
+}
+
+static lispval index_lookup(struct KNO_READSTAT_INDEX *ix,lispval key)
+{
+  lispval results = KNO_EMPTY;
+  unsigned int hash = hash_key(key);
+  size_t mask = ix->rsx_n_buckets-1, probe = hash&mask;
+  struct KNO_READSTAT_ENTRY *entries = ix->rsx_entries;
+  while (entries[probe].rse_observation) {
+    struct KNO_READSTAT_ENTRY *entry = &(entries[probe]);
+    if ( (entry->rse_hash == hash) && (keys_equalp(entry->rse_key,key)) ) {
+      lispval obs = kno_incref(entry->rse_observation);
+      KNO_ADD_TO_CHOICE(results,obs);}
+    probe = (probe+1)&mask;}
+  return kno_simplify_choice(results);
+}
+
+static void free_indexes(kno_readstat rs)
+{
+  int i = 0, n = rs->rs_n_indexes;
+  while (i<n) {
+    struct KNO_READSTAT_INDEX *ix = &(rs->rs_indexes[i++]);
+    struct KNO_READSTAT_ENTRY *entries = ix->rsx_entries;
+    size_t j = 0, n_buckets = ix->rsx_n_buckets;
+    while (j<n_buckets) {
+      if (entries[j].rse_observation) {
+	kno_decref(entries[j].rse_key);
+	kno_decref(entries[j].rse_observation);}
+      j++;}
+    u8_free(entries);}
+  if (rs->rs_indexes) u8_free(rs->rs_indexes);
+  rs->rs_indexes = NULL;
+  rs->rs_n_indexes = 0;
+}
+
+static void output_observation
+(kno_readstat rs,lispval observation,int obsid)
+{
+  if (rs->rs_n_shards > 0) {
+    lispval key = get_shard_key(rs,observation,obsid);
+    int shard = hash_key(key)%(rs->rs_n_shards);
+    kno_decref(key);
+    lispval *sinks = KNO_VECTOR_ELTS(rs->rs_shards);
+    sink_observation(rs,&(sinks[shard]),observation,obsid);}
+  else sink_observation(rs,&(rs->rs_output),observation,obsid);
+}
+
+/* Sparse observations */
+
+/* In sparse mode, values are collected into a scratch vector which is
+   reused for every row, along with the indexes of the cells which were
+   actually present. */
+
+static void clear_sparse_cells(kno_readstat rs)
+{
+  lispval *cells = rs->rs_scratch;
+  int *present = rs->rs_present;
+  int i = 0, n = rs->rs_n_present;
+  while (i<n) {
+    int slotno = present[i++];
+    kno_decref(cells[slotno]);
+    cells[slotno] = KNO_VOID;}
+  rs->rs_n_present = 0;
+}
+
+/* This makes an observation from the cells in the scratch vector,
+   emptying it. Rows are returned as slotmaps of the present cells
+   until the fill rate observed so far reaches the threshold; from then
+   on, every row is a full dataframe schemap, so that rows don't flip
+   between the two representations. */
+static lispval make_sparse_observation(kno_readstat rs)
+{
+  struct KNO_SCHEMAP *df = rs->rs_dataframe;
+  lispval *schema = df->table_schema;
+  lispval *cells = rs->rs_scratch;
+  int *present = rs->rs_present;
+  int i = 0, n_present = rs->rs_n_present, n_slots = df->schema_length;
+  lispval observation;
+  if (!((rs->rs_bits)&(KNO_READSTAT_DENSE))) {
+    rs->rs_cells_present += n_present;
+    rs->rs_cells_total += n_slots;
+    double fill = ((double)rs->rs_cells_present)/
+      ((double)rs->rs_cells_total);
+    if (fill >= rs->rs_sparse_threshold)
+      rs->rs_bits |= KNO_READSTAT_DENSE;}
+  if (!((rs->rs_bits)&(KNO_READSTAT_DENSE))) {
+    /* The slotmap takes over the references in the keyvals */
+    struct KNO_KEYVAL *kvals = rs->rs_keyvals;
+    while (i<n_present) {
+      int slotno = present[i];
+      kvals[i].kv_key = schema[slotno];
+      kvals[i].kv_val = cells[slotno];
+      cells[slotno] = KNO_VOID;
+      i++;}
+    observation = kno_make_slotmap(n_present,n_present,kvals);}
+  else {
+    observation = kno_make_schemap
+      (NULL,n_slots,KNO_DATAFRAME_SCHEMAP,schema,NULL);
+    lispval *values = ((kno_schemap)observation)->table_values;
+    while (i<n_slots) values[i++] = system_missing_value;
+    i = 0; while (i<n_present) {
+      int slotno = present[i++];
+      values[slotno] = cells[slotno];
+      cells[slotno] = KNO_VOID;}}
+  rs->rs_n_present = 0;
+  return observation;
+}
+
+static void emit_observation(kno_readstat rs,lispval observation,int obsid)
+{
+  if (rs->rs_n_indexes) index_observation(rs,observation);
+  output_observation(rs,observation,obsid);
+}
+
+/* Sorting */
+
+/* With the `sortby` option, finished observations are serialized into
+   runs which are sorted and spilled to temporary files in a background
+   thread while the parser fills the next run. When the parse is done,
+   the runs are merged and the observations emitted in key order. Each
+   cell is written as a code byte followed (for actual values) by its
+   DType representation, so missing values survive the round trip.
+   Sparse rows are written as (slot number, value) pairs. */
+
+#define SORTCELL_VOID    0
+#define SORTCELL_MISSING 1
+#define SORTCELL_TAGGED  2
+#define SORTCELL_DTYPE   255
+
+#define SORTREC_DENSE    'D'
+#define SORTREC_SPARSE   'S'
+
+#define DEFAULT_SORTMEM (128*1024*1024)
+/* The most spilled runs merged at once, which bounds the number of
+   open files */
+#define MAX_MERGE_FANIN 64
+
+typedef struct KNO_READSTAT_SORTREC {
+  long long rsr_obsid;
+  size_t rsr_off;
+  size_t rsr_len;
+  int rsr_n_keys;
+  lispval *rsr_keys;} *kno_readstat_sortrec;
+
+typedef struct KNO_READSTAT_RUN {
+  struct KNO_OUTBUF run_buf;
+  size_t run_keybytes;
+  size_t run_n;
+  size_t run_space;
+  struct KNO_READSTAT_SORTREC *run_recs;
+  lispval *run_keys;} *kno_readstat_run;
+
+typedef struct KNO_READSTAT_SORT {
+  int sort_n_keys;
+  lispval *sort_slotids;
+  int *sort_slotnos;
+  size_t sort_budget;
+  size_t sort_maxrec;
+  u8_string sort_dir;
+  struct KNO_READSTAT_RUN sort_runs[2];
+  int sort_filling;
+  FILE **sort_files;
+  int sort_n_files;
+  int sort_max_files;
+  pthread_t sort_thread;
+  int sort_busy;
+  struct KNO_READSTAT_RUN *spill_run;
+  FILE *spill_file;
+  int spill_status;
+  int spill_errno;} *kno_readstat_sort;
+
+static int sortkey_rank(lispval x)
+{
+  if (KNO_CONSTANTP(x))
+    return 0;
+  else if ( (KNO_FIXNUMP(x)) || (KNO_FLONUMP(x)) )
+    return 1;
+  else if (KNO_TYPEP(x,kno_timestamp_type))
+    return 2;
+  else if (KNO_STRINGP(x))
+    return 3;
+  else return 4;
+}
+
+static int compare_sortkeys(lispval a,lispval b)
+{
+  int a_rank = sortkey_rank(a), b_rank = sortkey_rank(b);
+  if (a_rank != b_rank)
+    return (a_rank<b_rank) ? (-1) : (1);
+  switch (a_rank) {
+  case 0:
+    return (a<b) ? (-1) : (a>b) ? (1) : (0);
+  case 1: {
+    double av = (KNO_FIXNUMP(a)) ? (KNO_FIX2INT(a)) : (KNO_FLONUM(a));
+    double bv = (KNO_FIXNUMP(b)) ? (KNO_FIX2INT(b)) : (KNO_FLONUM(b));
+    return (av<bv) ? (-1) : (av>bv) ? (1) : (0);}
+  case 2: {
+    struct U8_XTIME *at = &(((kno_timestamp)a)->u8xtimeval);
+    struct U8_XTIME *bt = &(((kno_timestamp)b)->u8xtimeval);
+    if (at->u8_tick != bt->u8_tick)
+      return (at->u8_tick<bt->u8_tick) ? (-1) : (1);
+    return (at->u8_nsecs<bt->u8_nsecs) ? (-1) :
+      (at->u8_nsecs>bt->u8_nsecs) ? (1) : (0);}
+  case 3:
+    return strcmp(KNO_CSTRING(a),KNO_CSTRING(b));
+  default:
+    return 0;
+  }
+}
+
+static int compare_sortrecs(const void *vx,const void *vy)
+{
+  const struct KNO_READSTAT_SORTREC *x = vx, *y = vy;
+  int i = 0, n = x->rsr_n_keys;
+  while (i<n) {
+    int cmp = compare_sortkeys(x->rsr_keys[i],y->rsr_keys[i]);
+    if (cmp) return cmp;
+    else i++;}
+  /* Ties keep file order */
+  return (x->rsr_obsid<y->rsr_obsid) ? (-1) :
+    (x->rsr_obsid>y->rsr_obsid) ? (1) : (0);
+}
+
+static void init_run(struct KNO_READSTAT_RUN *run,int n_keys)
+{
+  KNO_INIT_BYTE_OUTPUT(&(run->run_buf),64*1024);
+  run->run_keybytes = 0;
+  run->run_n = 0;
+  run->run_space = 1024;
+  run->run_recs = u8_alloc_n(run->run_space,struct KNO_READSTAT_SORTREC);
+  run->run_keys = u8_alloc_n(run->run_space*n_keys,lispval);
+}
+
+static void clear_run(struct KNO_READSTAT_RUN *run,int n_keys)
+{
+  lispval *keys = run->run_keys;
+  size_t i = 0, n = run->run_n*n_keys;
+  while (i<n) { kno_decref(keys[i]); i++; }
+  run->run_n = 0;
+  run->run_keybytes = 0;
+  run->run_buf.bufwrite = run->run_buf.buffer;
+}
+
+static void free_run(struct KNO_READSTAT_RUN *run,int n_keys)
+{
+  clear_run(run,n_keys);
+  kno_close_outbuf(&(run->run_buf));
+  u8_free(run->run_recs);
+  u8_free(run->run_keys);
+}
+
+/* This estimates the memory held by a key which a run keeps a
+   reference to; immediate values don't take any */
+static size_t sortkey_size(lispval key)
+{
+  if ( (KNO_FIXNUMP(key)) || (KNO_CONSTANTP(key)) )
+    return 0;
+  else if (KNO_STRINGP(key))
+    return 32+KNO_STRLEN(key);
+  else if (KNO_FLONUMP(key))
+    return 16;
+  else return 64;
+}
+
+/* This estimates the memory a run would hold after adding a record of
+   *reclen* bytes. The buffer and arrays grow by doubling and keep their
+   size when the run is cleared, so it's their capacity which counts. */
+static size_t run_grown_size(struct KNO_READSTAT_RUN *run,int n_keys,
+			     size_t reclen)
+{
+  size_t bufspace = run->run_buf.buflim-run->run_buf.buffer;
+  size_t needed = (run->run_buf.bufwrite-run->run_buf.buffer)+reclen;
+  size_t space = run->run_space;
+  while (bufspace < needed) bufspace = bufspace*2;
+  if (run->run_n >= space) space = space*2;
+  return bufspace+run->run_keybytes+
+    (space*(sizeof(struct KNO_READSTAT_SORTREC)+n_keys*sizeof(lispval)));
+}
+
+static void sort_run(struct KNO_READSTAT_RUN *run,int n_keys)
+{
+  struct KNO_READSTAT_SORTREC *recs = run->run_recs;
+  size_t i = 0, n = run->run_n;
+  /* The key arrays may have moved as the run grew */
+  while (i<n) { recs[i].rsr_keys = run->run_keys+(i*n_keys); i++; }
+  qsort(recs,n,sizeof(struct KNO_READSTAT_SORTREC),compare_sortrecs);
+}
+
+static void *spill_run(void *arg)
+{
+  struct KNO_READSTAT_SORT *sort = arg;
+  struct KNO_READSTAT_RUN *run = sort->spill_run;
+  FILE *f = sort->spill_file;
+  sort_run(run,sort->sort_n_keys);
+  struct KNO_READSTAT_SORTREC *recs = run->run_recs;
+  size_t i = 0, n = run->run_n;
+  while (i<n) {
+    unsigned int len = recs[i].rsr_len;
+    long long obsid = recs[i].rsr_obsid;
+    if ( (fwrite(&len,sizeof(len),1,f) != 1) ||
+	 (fwrite(&obsid,sizeof(obsid),1,f) != 1) ||
+	 (fwrite(run->run_buf.buffer+recs[i].rsr_off,1,len,f) != len) ) {
+      /* errno is per-thread, so save it for wait_spill() */
+      sort->spill_errno = errno;
+      sort->spill_status = -1;
+      return NULL;}
+    i++;}
+  if (fflush(f) == 0)
+    sort->spill_status = 0;
+  else {
+    sort->spill_errno = errno;
+    sort->spill_status = -1;}
+  return NULL;
+}
+
+static int wait_spill(struct KNO_READSTAT_SORT *sort)
+{
+  if (!(sort->sort_busy)) return 0;
+  pthread_join(sort->sort_thread,NULL);
+  sort->sort_busy = 0;
+  clear_run(sort->spill_run,sort->sort_n_keys);
+  if (sort->spill_status<0) {
+    kno_seterr("ReadStatSpillFailed","wait_spill",
+	       strerror(sort->spill_errno),KNO_VOID);
+    return -1;}
+  else return 0;
+}
+
+/* This opens an anonymous spill file in the sort directory; it's
+   unlinked right away so it goes away when it's closed */
+static FILE *open_spill_file(struct KNO_READSTAT_SORT *sort,u8_context cxt)
+{
+  u8_string path = u8_mkstring("%s/readstat-XXXXXX",sort->sort_dir);
+  int fd = mkstemp((char *)path);
+  FILE *f = (fd<0) ? (NULL) : (fdopen(fd,"w+b"));
+  if (f == NULL) {
+    int err = errno;
+    if (fd>=0) { unlink(path); close(fd); }
+    lispval dir = kno_make_string(NULL,-1,sort->sort_dir);
+    kno_seterr("ReadStatSpillFailed",cxt,strerror(err),dir);
+    kno_decref(dir);
+    u8_free(path);
+    return NULL;}
+  unlink(path);
+  u8_free(path);
+  return f;
+}
+
+static void add_spill_file(struct KNO_READSTAT_SORT *sort,FILE *f)
+{
+  if (sort->sort_n_files >= sort->sort_max_files) {
+    int new_max = sort->sort_max_files*2;
+    sort->sort_files = u8_realloc_n(sort->sort_files,new_max,FILE *);
+    sort->sort_max_files = new_max;}
+  sort->sort_files[sort->sort_n_files++] = f;
+}
+
+static int start_spill(struct KNO_READSTAT_SORT *sort)
+{
+  if (wait_spill(sort)<0) return -1;
+  FILE *f = open_spill_file(sort,"start_spill");
+  if (f == NULL) return -1;
+  add_spill_file(sort,f);
+  sort->spill_run  = &(sort->sort_runs[sort->sort_filling]);
+  sort->spill_file = f;
+  sort->spill_status = 0;
+  sort->spill_errno = 0;
+  sort->sort_filling = !(sort->sort_filling);
+  if (pthread_create(&(sort->sort_thread),NULL,spill_run,sort)) {
+    /* If we can't start a thread, just spill synchronously */
+    spill_run(sort);
+    clear_run(sort->spill_run,sort->sort_n_keys);
+    if (sort->spill_status<0) {
+      kno_seterr("ReadStatSpillFailed","start_spill",
+		 strerror(sort->spill_errno),KNO_VOID);
+      return -1;}}
+  else sort->sort_busy = 1;
+  return 0;
+}
+
+static int write_sortcell(struct KNO_OUTBUF *out,lispval v)
+{
+  if (KNO_VOIDP(v))
+    return kno_write_byte(out,SORTCELL_VOID);
+  else if (v == system_missing_value)
+    return kno_write_byte(out,SORTCELL_MISSING);
+  else if (KNO_CONSTANTP(v)) {
+    int i = 0; while (i<26) {
+      if (v == tagged_missing_values[i])
+	return kno_write_byte(out,SORTCELL_TAGGED+i);
+      else i++;}}
   else NO_ELSE;
+  if (kno_write_byte(out,SORTCELL_DTYPE)<0) return -1;
+  else return kno_write_dtype(out,v);
+}
+
+static lispval read_sortcell(struct KNO_INBUF *in)
+{
+  int code = kno_read_byte(in);
+  if (code == SORTCELL_VOID)
+    return KNO_VOID;
+  else if (code == SORTCELL_MISSING)
+    return system_missing_value;
+  else if ( (code >= SORTCELL_TAGGED) && (code < (SORTCELL_TAGGED+26)) )
+    return tagged_missing_values[code-SORTCELL_TAGGED];
+  else return kno_read_dtype(in);
+}
+
+static lispval read_sorted_observation(kno_readstat rs,
+				       const unsigned char *bytes,size_t len,
+				       lispval *keys)
+{
+  struct KNO_SCHEMAP *df = rs->rs_dataframe;
+  struct KNO_READSTAT_SORT *sort = rs->rs_sort;
+  int i = 0, n = df->schema_length;
+  struct KNO_INBUF in;
+  KNO_INIT_BYTE_INPUT(&in,bytes,len);
+  lispval *values, observation;
+  if (kno_read_byte(&in) == SORTREC_SPARSE) {
+    lispval count = read_sortcell(&in);
+    int n_cells = (KNO_FIXNUMP(count)) ? (KNO_FIX2INT(count)) : (-1);
+    if (n_cells<0) return KNO_ERROR;
+    values = rs->rs_scratch;
+    while (i<n_cells) {
+      lispval slot = read_sortcell(&in);
+      lispval v = read_sortcell(&in);
+      int slotno = (KNO_FIXNUMP(slot)) ? (KNO_FIX2INT(slot)) : (-1);
+      if ( (KNO_ABORTED(v)) || (slotno<0) || (slotno>=n) ) {
+	clear_sparse_cells(rs);
+	return KNO_ERROR;}
+      else if (KNO_VOIDP(values[slotno]))
+	rs->rs_present[rs->rs_n_present++] = slotno;
+      else kno_decref(values[slotno]);
+      values[slotno] = v;
+      i++;}}
+  else {
+    observation = kno_make_schemap
+      (NULL,n,KNO_DATAFRAME_SCHEMAP,df->table_schema,NULL);
+    values = ((kno_schemap)observation)->table_values;
+    while (i<n) {
+      lispval v = read_sortcell(&in);
+      if (KNO_ABORTED(v)) {
+	while (i<n) values[i++] = KNO_VOID;
+	kno_decref(observation);
+	return KNO_ERROR;}
+      values[i++] = v;}}
+  /* The keys are borrowed from the values, which are still referenced
+     by the observation we return */
+  if (keys) {
+    i = 0; while (i<sort->sort_n_keys) {
+      int slotno = sort->sort_slotnos[i];
+      keys[i++] = (slotno<0) ? (KNO_VOID) : (values[slotno]);}}
+  if (values == rs->rs_scratch)
+    return make_sparse_observation(rs);
+  else return observation;
+}
+
+/* This adds a row to the current run. When *present* is NULL, *values*
+   is a full row; otherwise, only the *n_present* cells it lists are
+   written. */
+static int sort_cells(kno_readstat rs,lispval *values,
+		      int n_present,int *present,int obsid)
+{
+  struct KNO_READSTAT_SORT *sort = rs->rs_sort;
+  struct KNO_READSTAT_RUN *run = &(sort->sort_runs[sort->sort_filling]);
+  int n_slots = rs->rs_dataframe->schema_length;
+  int n_keys = sort->sort_n_keys;
+  int *slotnos = sort->sort_slotnos;
+  if (slotnos[0] == -1) {
+    int i = 0; while (i<n_keys) {
+      int slotno = get_slotno(rs,sort->sort_slotids[i]);
+      if (slotno<0)
+	u8_log(LOGWARN,"ReadStatSortKey",
+	       "The sort key %q isn't a variable of %s",
+	       sort->sort_slotids[i],rs->rs_source);
+      slotnos[i++] = (slotno<0) ? (-2) : (slotno);}}
+  /* Spill the run rather than let it grow past the budget, using the
+     largest record so far as the size of this one */
+  if ( (run->run_n) &&
+       (run_grown_size(run,n_keys,sort->sort_maxrec) > sort->sort_budget) ) {
+    if (start_spill(sort)<0) return -1;
+    run = &(sort->sort_runs[sort->sort_filling]);}
+  if (run->run_n >= run->run_space) {
+    size_t new_space = run->run_space*2;
+    run->run_recs = u8_realloc_n(run->run_recs,new_space,
+				 struct KNO_READSTAT_SORTREC);
+    run->run_keys = u8_realloc_n(run->run_keys,new_space*n_keys,lispval);
+    run->run_space = new_space;}
+  struct KNO_READSTAT_SORTREC *rec = &(run->run_recs[run->run_n]);
+  lispval *keys = run->run_keys+(run->run_n*n_keys);
+  int i = 0; while (i<n_keys) {
+    int slotno = slotnos[i];
+    keys[i] = (slotno<0) ? (KNO_VOID) : (kno_incref(values[slotno]));
+    run->run_keybytes += sortkey_size(keys[i]);
+    i++;}
+  struct KNO_OUTBUF *out = &(run->run_buf);
+  rec->rsr_obsid = obsid;
+  rec->rsr_off = out->bufwrite-out->buffer;
+  rec->rsr_n_keys = n_keys;
+  rec->rsr_keys = NULL;
+  int rv = 0;
+  if (present) {
+    rv = kno_write_byte(out,SORTREC_SPARSE);
+    if (rv>=0) rv = write_sortcell(out,KNO_INT(n_present));
+    i = 0; while ( (rv>=0) && (i<n_present) ) {
+      int slotno = present[i++];
+      rv = write_sortcell(out,KNO_INT(slotno));
+      if (rv>=0) rv = write_sortcell(out,values[slotno]);}}
+  else {
+    rv = kno_write_byte(out,SORTREC_DENSE);
+    i = 0; while ( (rv>=0) && (i<n_slots) )
+      rv = write_sortcell(out,values[i++]);}
+  if (rv<0) {
+    /* Drop the partial record */
+    out->bufwrite = out->buffer+rec->rsr_off;
+    i = 0; while (i<n_keys) {
+      run->run_keybytes -= sortkey_size(keys[i]);
+      kno_decref(keys[i++]);}
+    return -1;}
+  rec->rsr_len = (out->bufwrite-out->buffer)-rec->rsr_off;
+  if (rec->rsr_len > sort->sort_maxrec) sort->sort_maxrec = rec->rsr_len;
+  run->run_n++;
+  return 0;
+}
+
+typedef struct KNO_READSTAT_MERGESTREAM {
+  FILE *ms_file;
+  unsigned char *ms_buf;
+  size_t ms_space;
+  long long ms_obsid;
+  lispval ms_observation;
+  struct KNO_READSTAT_SORTREC ms_rec;
+  lispval *ms_keys;} *kno_readstat_mergestream;
+
+/* This reads the next observation from a spilled run, returning 1 if
+   there was one, 0 at the end of the run, and -1 on errors */
+static int merge_next(kno_readstat rs,struct KNO_READSTAT_MERGESTREAM *ms)
+{
+  unsigned int len; long long obsid;
+  ms->ms_observation = KNO_VOID;
+  if (fread(&len,sizeof(len),1,ms->ms_file) != 1) return 0;
+  if (fread(&obsid,sizeof(obsid),1,ms->ms_file) != 1) return -1;
+  if (len > ms->ms_space) {
+    ms->ms_buf = u8_realloc(ms->ms_buf,len);
+    ms->ms_space = len;}
+  if (fread(ms->ms_buf,1,len,ms->ms_file) != len) return -1;
+  lispval observation =
+    read_sorted_observation(rs,ms->ms_buf,len,ms->ms_keys);
+  if (KNO_ABORTED(observation)) return -1;
+  ms->ms_obsid = obsid;
+  ms->ms_observation = observation;
+  ms->ms_rec.rsr_obsid = obsid;
+  ms->ms_rec.rsr_len = len;
+  return 1;
+}
+
+static int merge_lessp(struct KNO_READSTAT_MERGESTREAM *x,
+		       struct KNO_READSTAT_MERGESTREAM *y)
+{
+  return compare_sortrecs(&(x->ms_rec),&(y->ms_rec)) < 0;
+}
+
+static void merge_sift(struct KNO_READSTAT_MERGESTREAM **heap,int n,int i)
+{
+  while (1) {
+    int least = i, l = 2*i+1, r = 2*i+2;
+    if ( (l<n) && (merge_lessp(heap[l],heap[least])) ) least = l;
+    if ( (r<n) && (merge_lessp(heap[r],heap[least])) ) least = r;
+    if (least == i) return;
+    struct KNO_READSTAT_MERGESTREAM *tmp = heap[i];
+    heap[i] = heap[least]; heap[least] = tmp;
+    i = least;}
+}
+
+/* This merges *n_files* spilled runs, either emitting the observations
+   or, when *out* is given, writing them to *out* as a single longer
+   run */
+static int merge_files(kno_readstat rs,FILE **files,int n_files,FILE *out)
+{
+  struct KNO_READSTAT_SORT *sort = rs->rs_sort;
+  int i = 0, n_keys = sort->sort_n_keys;
+  int n_live = 0, status = 0;
+  struct KNO_READSTAT_MERGESTREAM *streams =
+    u8_alloc_n(n_files,struct KNO_READSTAT_MERGESTREAM);
+  struct KNO_READSTAT_MERGESTREAM **heap =
+    u8_alloc_n(n_files,struct KNO_READSTAT_MERGESTREAM *);
+  while (i<n_files) {
+    struct KNO_READSTAT_MERGESTREAM *ms = &(streams[i]);
+    ms->ms_file = files[i];
+    ms->ms_buf = u8_malloc(4096);
+    ms->ms_space = 4096;
+    ms->ms_keys = u8_alloc_n(n_keys,lispval);
+    ms->ms_rec.rsr_n_keys = n_keys;
+    ms->ms_rec.rsr_keys = ms->ms_keys;
+    rewind(ms->ms_file);
+    int rv = merge_next(rs,ms);
+    if (rv>0) heap[n_live++] = ms;
+    else if (rv<0) status = -1;
+    i++;}
+  i = n_live/2; while (i>0) merge_sift(heap,n_live,--i);
+  while ( (n_live>0) && (status == 0) ) {
+    struct KNO_READSTAT_MERGESTREAM *ms = heap[0];
+    lispval observation = ms->ms_observation;
+    if (out == NULL)
+      emit_observation(rs,observation,ms->ms_obsid);
+    else {
+      /* Copy the encoded record, which merge_next() is about to
+	 overwrite */
+      unsigned int len = ms->ms_rec.rsr_len;
+      long long obsid = ms->ms_obsid;
+      kno_decref(observation);
+      ms->ms_observation = KNO_VOID;
+      if ( (fwrite(&len,sizeof(len),1,out) != 1) ||
+	   (fwrite(&obsid,sizeof(obsid),1,out) != 1) ||
+	   (fwrite(ms->ms_buf,1,len,out) != len) ) {
+	kno_seterr("ReadStatSpillFailed","merge_files",
+		   strerror(errno),KNO_VOID);
+	status = -1;
+	break;}}
+    int rv = merge_next(rs,ms);
+    if (rv<0) status = -1;
+    else if (rv == 0) heap[0] = heap[--n_live];
+    else NO_ELSE;
+    merge_sift(heap,n_live,0);}
+  if ( (out) && (status == 0) && (fflush(out) != 0) ) {
+    kno_seterr("ReadStatSpillFailed","merge_files",strerror(errno),KNO_VOID);
+    status = -1;}
+  i = 0; while (i<n_files) {
+    struct KNO_READSTAT_MERGESTREAM *ms = &(streams[i++]);
+    if (status<0) kno_decref(ms->ms_observation);
+    u8_free(ms->ms_buf);
+    u8_free(ms->ms_keys);}
+  u8_free(heap);
+  u8_free(streams);
+  if ( (status<0) && (!(u8_current_exception)) )
+    kno_seterr("ReadStatMergeFailed","merge_files",rs->rs_source,KNO_VOID);
+  return status;
+}
+
+/* This merges the spilled runs, first combining them in groups of
+   MAX_MERGE_FANIN until there are few enough to merge at once */
+static int merge_runs(kno_readstat rs)
+{
+  struct KNO_READSTAT_SORT *sort = rs->rs_sort;
+  while (sort->sort_n_files > MAX_MERGE_FANIN) {
+    FILE **files = sort->sort_files;
+    int n_files = sort->sort_n_files, start = 0;
+    sort->sort_files = u8_alloc_n(sort->sort_max_files,FILE *);
+    sort->sort_n_files = 0;
+    while (start<n_files) {
+      int n = n_files-start, status = 0;
+      if (n > MAX_MERGE_FANIN) n = MAX_MERGE_FANIN;
+      FILE *out = (n == 1) ? (files[start]) :
+	(open_spill_file(sort,"merge_runs"));
+      if (out == NULL) status = -1;
+      else if (out != files[start])
+	status = merge_files(rs,files+start,n,out);
+      else NO_ELSE;
+      /* Keep the unmerged files and the new run where free_sort()
+	 will close them */
+      if (out) add_spill_file(sort,out);
+      if (status<0) {
+	int i = start; while (i<n_files) {
+	  if (files[i] != out) add_spill_file(sort,files[i]);
+	  i++;}
+	u8_free(files);
+	return -1;}
+      if (out != files[start]) {
+	int i = start; while (i<start+n) fclose(files[i++]);}
+      start += n;}
+    u8_free(files);}
+  return merge_files(rs,sort->sort_files,sort->sort_n_files,NULL);
+}
+
+/* This is called when parsing is done and emits all of the sorted
+   observations */
+static int finish_sort(kno_readstat rs)
+{
+  struct KNO_READSTAT_SORT *sort = rs->rs_sort;
+  struct KNO_READSTAT_RUN *run = &(sort->sort_runs[sort->sort_filling]);
+  int n_keys = sort->sort_n_keys;
+  if (sort->sort_n_files == 0) {
+    /* Everything fit in memory */
+    sort_run(run,n_keys);
+    struct KNO_READSTAT_SORTREC *recs = run->run_recs;
+    size_t i = 0, n = run->run_n;
+    while (i<n) {
+      struct KNO_READSTAT_SORTREC *rec = &(recs[i++]);
+      lispval observation = read_sorted_observation
+	(rs,run->run_buf.buffer+rec->rsr_off,rec->rsr_len,NULL);
+      if (KNO_ABORTED(observation)) {
+	clear_run(run,n_keys);
+	return -1;}
+      emit_observation(rs,observation,rec->rsr_obsid);}
+    clear_run(run,n_keys);
+    return 0;}
+  if ( (run->run_n) && (start_spill(sort)<0) ) return -1;
+  if (wait_spill(sort)<0) return -1;
+  int rv = merge_runs(rs);
+  int i = 0; while (i<sort->sort_n_files) fclose(sort->sort_files[i++]);
+  sort->sort_n_files = 0;
+  return rv;
+}
+
+static struct KNO_READSTAT_SORT *make_sort(lispval sortby,lispval sortmem,
+					   lispval sortdir)
+{
+  int i = 0, n = (KNO_VECTORP(sortby)) ? (KNO_VECTOR_LENGTH(sortby)) : (1);
+  if (n == 0) {
+    kno_seterr("ReadStatBadSortKey","make_sort",NULL,sortby);
+    return NULL;}
+  while (i<n) {
+    lispval slotid = (KNO_VECTORP(sortby)) ?
+      (KNO_VECTOR_REF(sortby,i)) : (sortby);
+    if (!(KNO_SYMBOLP(slotid))) {
+      kno_seterr("ReadStatBadSortKey","make_sort",NULL,slotid);
+      return NULL;}
+    i++;}
+  if (! ( (KNO_VOIDP(sortdir)) || (KNO_FALSEP(sortdir)) ||
+	  (KNO_STRINGP(sortdir)) ) ) {
+    kno_seterr("ReadStatBadSortDir","make_sort",NULL,sortdir);
+    return NULL;}
+  struct KNO_READSTAT_SORT *sort = u8_alloc(struct KNO_READSTAT_SORT);
+  memset(sort,0,sizeof(struct KNO_READSTAT_SORT));
+  sort->sort_n_keys = n;
+  sort->sort_slotids = u8_alloc_n(n,lispval);
+  sort->sort_slotnos = u8_alloc_n(n,int);
+  i = 0; while (i<n) {
+    sort->sort_slotids[i] = (KNO_VECTORP(sortby)) ?
+      (KNO_VECTOR_REF(sortby,i)) : (sortby);
+    sort->sort_slotnos[i] = -1;
+    i++;}
+  long long budget = (KNO_FIXNUMP(sortmem)) ? (KNO_FIX2INT(sortmem)) :
+    (DEFAULT_SORTMEM);
+  if (budget < (1024*1024)) budget = 1024*1024;
+  /* One run fills while the other is being spilled */
+  sort->sort_budget = budget/2;
+  init_run(&(sort->sort_runs[0]),n);
+  init_run(&(sort->sort_runs[1]),n);
+  sort->sort_max_files = 16;
+  sort->sort_files = u8_alloc_n(sort->sort_max_files,FILE *);
+  if (KNO_STRINGP(sortdir))
+    sort->sort_dir = u8_strdup(KNO_CSTRING(sortdir));
+  else {
+    char *tmpdir = getenv("TMPDIR");
+    sort->sort_dir = u8_strdup(((tmpdir) && (*tmpdir)) ? (tmpdir) : ("/tmp"));}
+  return sort;
+}
+
+static void free_sort(struct KNO_READSTAT_SORT *sort)
+{
+  if (sort->sort_busy) {
+    pthread_join(sort->sort_thread,NULL);
+    sort->sort_busy = 0;}
+  free_run(&(sort->sort_runs[0]),sort->sort_n_keys);
+  free_run(&(sort->sort_runs[1]),sort->sort_n_keys);
+  int i = 0; while (i<sort->sort_n_files) fclose(sort->sort_files[i++]);
+  u8_free(sort->sort_files);
+  u8_free(sort->sort_dir);
+  u8_free(sort->sort_slotids);
+  u8_free(sort->sort_slotnos);
+  u8_free(sort);
 }
 
 static void finish_observation(kno_readstat rs)
 {
-  if ( (rs->rs_obsid >= 0) && (rs->rs_observation) ) {
-    lispval observation = (lispval) rs->rs_observation;
+  if ( (rs->rs_obsid >= 0) && (rs->rs_values) ) {
+    int sparse = ((rs->rs_bits)&(KNO_READSTAT_SPARSE));
+    unsigned long long row_hash =
+      ((rs->rs_bits)&(KNO_READSTAT_RESUMING)) ? (hash_row(rs)) : (0);
+    lispval observation = (sparse) ? (KNO_VOID) :
+      ((lispval) rs->rs_observation);
     rs->rs_observation = NULL;
-    int obsid = rs->rs_obsid; rs->rs_obsid = -1;
-    output_observation(rs,observation,obsid);}
+    rs->rs_values = NULL;
+    int obsid = rs->rs_obsid+rs->rs_row_offset; rs->rs_obsid = -1;
+    rs->rs_last_row  = obsid;
+    if ((rs->rs_bits)&(KNO_READSTAT_RESUMING)) {
+      /* When resuming, the first row is the last row of the previous
+	 load and is only used to check that the file was appended to. */
+      rs->rs_bits &= ~KNO_READSTAT_RESUMING;
+      if (row_hash != rs->rs_since_row)
+	rs->rs_bits |= KNO_READSTAT_STALE;
+      rs->rs_counter--;
+      if (sparse) clear_sparse_cells(rs);
+      else kno_decref(observation);}
+    else if (rs->rs_sort) {
+      int rv = (sparse) ?
+	(sort_cells(rs,rs->rs_scratch,rs->rs_n_present,rs->rs_present,obsid)) :
+	(sort_cells(rs,((kno_schemap)observation)->table_values,0,NULL,obsid));
+      if (sparse) clear_sparse_cells(rs);
+      else kno_decref(observation);
+      if (rv<0) rs->rs_bits |= KNO_READSTAT_FAILED;}
+    else {
+      if (sparse) observation = make_sparse_observation(rs);
+      emit_observation(rs,observation,obsid);}}
 }
 
 static void init_observation(kno_readstat rs,long long obsv)
@@ -434,6 +1768,14 @@ static void init_observation(kno_readstat rs,long long obsv)
     finish_observation(rs);
   else NO_ELSE;
   rs->rs_obsid = obsv;
+  rs->rs_counter++;
+  if ((rs->rs_bits)&(KNO_READSTAT_SPARSE)) {
+    rs->rs_values = rs->rs_scratch;
+    rs->rs_observation = NULL;
+    if (rs->rs_n_slots>rs->rs_n_vars) {
+      rs->rs_scratch[rs->rs_n_vars]=KNO_INT(obsv+rs->rs_row_offset);
+      rs->rs_present[rs->rs_n_present++]=rs->rs_n_vars;}
+    return;}
   struct KNO_SCHEMAP *df = rs->rs_dataframe;
   int n = df->schema_length;
   lispval sv = kno_make_schemap
@@ -444,8 +1786,8 @@ static void init_observation(kno_readstat rs,long long obsv)
   rs->rs_values = values;
   rs->rs_observation = observation;
   /* Initialize the observation field if specified */
-  if (rs->rs_n_slots>rs->rs_n_vars) values[rs->rs_n_vars]=KNO_INT(obsv);
-  rs->rs_counter++;
+  if (rs->rs_n_slots>rs->rs_n_vars)
+    values[rs->rs_n_vars]=KNO_INT(obsv+rs->rs_row_offset);
 }
 
 static int value_handler(int obs_index,
@@ -454,13 +1796,27 @@ static int value_handler(int obs_index,
 			 void *state)
 {
   struct KNO_READSTAT *rs = (kno_readstat) state;
+  if ( ((rs->rs_bits)&(KNO_READSTAT_RESUMING)) &&
+       (rs->rs_schema_hash != rs->rs_since_schema) )
+    rs->rs_bits |= KNO_READSTAT_STALE;
   if (obs_index != rs->rs_obsid) {
     if (rs->rs_obsid>=0)
       finish_observation(rs);
+    if ((rs->rs_bits)&(KNO_READSTAT_STALE|KNO_READSTAT_FAILED))
+      return READSTAT_HANDLER_ABORT;
     init_observation(rs,obs_index);}
   int var_index = vd->index;
-  lispval value = get_lisp_value(&val);
+  lispval value = ( (rs->rs_datekinds) && (rs->rs_datekinds[var_index]) &&
+		    (!(val.is_system_missing)) && (!(val.is_tagged_missing)) ) ?
+    (convert_date_value(rs,rs->rs_datekinds[var_index],&val)) :
+    (get_lisp_value(rs,&val));
   lispval *values = rs->rs_values;
+  if ((rs->rs_bits)&(KNO_READSTAT_SPARSE)) {
+    if ( (value == system_missing_value) || (KNO_VOIDP(value)) )
+      return READSTAT_HANDLER_OK;
+    else if (KNO_VOIDP(values[var_index]))
+      rs->rs_present[rs->rs_n_present++]=var_index;
+    else kno_decref(values[var_index]);}
   values[var_index]=value;
   return READSTAT_HANDLER_OK;
 }
@@ -497,6 +1853,7 @@ kno_readstat create_readstat(lispval opts)
   result->rs_n_vars = -1;
   result->rs_parser = parser;
   result->rs_text_encoding = NULL;
+  U8_INIT_OUTPUT(&(result->rs_textbuf),256);
   result->rs_idslot = kno_getopt(opts,KNOSYM(idslot),KNO_VOID);
   result->rs_vlabels = kno_getopt(opts,KNOSYM(labels),KNO_VOID);
 
@@ -513,6 +1870,141 @@ kno_readstat create_readstat(lispval opts)
     result->rs_output    = kno_init_prechoice(NULL,100,1);
   else result->rs_output = KNO_EMPTY_LIST;
   result->rs_counter = 0;
+  result->rs_n_indexes = 0;
+  result->rs_indexes = NULL;
+  result->rs_sort = NULL;
+  result->rs_values = NULL;
+  result->rs_scratch = NULL;
+  result->rs_present = NULL;
+  result->rs_keyvals = NULL;
+  result->rs_n_present = 0;
+  result->rs_sparse_threshold = 0;
+  result->rs_cells_present = 0;
+  result->rs_cells_total = 0;
+  result->rs_dates = 0;
+  result->rs_datekinds = NULL;
+
+  result->rs_shards = KNO_VOID;
+  result->rs_n_shards = 0;
+  result->rs_shardslot = -1;
+  result->rs_shardkey = KNO_VOID;
+  result->rs_row_offset = 0;
+  result->rs_last_row = -1;
+  result->rs_schema_hash = 0;
+  result->rs_last_hash = 0;
+  result->rs_since_schema = 0;
+  result->rs_since_row = 0;
+  lispval shards = kno_getopt(opts,KNOSYM(shards),KNO_VOID);
+  if ( (KNO_VECTORP(shards)) &&
+       (! ( (KNO_VOIDP(output)) || (KNO_FALSEP(output)) ||
+	    (KNO_EMPTYP(output)) ) ) ) {
+    kno_seterr("ReadStatShardsAndOutput","create_readstat",
+	       "The output and shards options can't be combined",output);
+    kno_decref(shards);
+    kno_decref((lispval)result);
+    return NULL;}
+  else if ( (KNO_VECTORP(shards)) && (KNO_VECTOR_LENGTH(shards) == 0) ) {
+    kno_seterr("ReadStatBadShards","create_readstat",
+	       "The shards vector is empty",shards);
+    kno_decref(shards);
+    kno_decref((lispval)result);
+    return NULL;}
+  else if (KNO_VECTORP(shards)) {
+    int i = 0, n = KNO_VECTOR_LENGTH(shards);
+    lispval sinks = kno_make_vector(n,NULL);
+    while (i<n) {
+      lispval sink = KNO_VECTOR_REF(shards,i);
+      if ( (KNO_APPLICABLEP(sink)) ||
+	   (KNO_TYPEP(sink,kno_future_type)) ||
+	   (KNO_EMPTY_LISTP(sink)) ) {
+	kno_incref(sink);
+	KNO_VECTOR_SET(sinks,i,sink);}
+      else if ( (KNO_FALSEP(sink)) || (KNO_EMPTYP(sink)) ) {
+	KNO_VECTOR_SET(sinks,i,kno_init_prechoice(NULL,100,1));}
+      else {
+	kno_seterr("ReadStatBadShard","create_readstat",NULL,sink);
+	kno_decref(sinks);
+	kno_decref(shards);
+	kno_decref((lispval)result);
+	return NULL;}
+      i++;}
+    result->rs_shards = sinks;
+    result->rs_n_shards = n;
+    result->rs_shardkey = kno_getopt(opts,KNOSYM(shardkey),result->rs_idslot);}
+  else if (! ((KNO_VOIDP(shards)) || (KNO_FALSEP(shards))) ) {
+    kno_seterr("ReadStatBadShards","create_readstat",NULL,shards);
+    kno_decref(shards);
+    kno_decref((lispval)result);
+    return NULL;}
+  else NO_ELSE;
+  kno_decref(shards);
+
+  lispval index = kno_getopt(opts,KNOSYM(index),KNO_VOID);
+  if ( (KNO_TRUEP(index)) &&
+       ( (KNO_VOIDP(result->rs_idslot)) || (KNO_FALSEP(result->rs_idslot)) ) ) {
+    kno_seterr("ReadStatBadIndex","create_readstat",
+	       "index #t requires an idslot",index);
+    kno_decref(index);
+    kno_decref((lispval)result);
+    return NULL;}
+  else if (KNO_TRUEP(index)) {
+    kno_decref(index);
+    index = kno_incref(result->rs_idslot);}
+  if (! ((KNO_VOIDP(index)) || (KNO_FALSEP(index))) ) {
+    int n = (KNO_VECTORP(index)) ? (KNO_VECTOR_LENGTH(index)) :
+      (KNO_CHOICE_SIZE(index));
+    lispval *slotids = u8_alloc_n(n,lispval);
+    int i = 0;
+    if (KNO_VECTORP(index)) {
+      while (i<n) { slotids[i] = KNO_VECTOR_REF(index,i); i++; }}
+    else {
+      KNO_DO_CHOICES(slotid,index) { slotids[i++] = slotid; }}
+    result->rs_indexes = u8_alloc_n(n,struct KNO_READSTAT_INDEX);
+    i = 0; while (i<n) {
+      lispval slotid = slotids[i];
+      if (!(KNO_SYMBOLP(slotid))) {
+	kno_seterr("ReadStatBadIndex","create_readstat",NULL,slotid);
+	u8_free(slotids);
+	kno_decref(index);
+	kno_decref((lispval)result);
+	return NULL;}
+      init_index(&(result->rs_indexes[i]),slotid,1024);
+      result->rs_n_indexes = ++i;}
+    u8_free(slotids);}
+  kno_decref(index);
+
+  lispval sortby = kno_getopt(opts,KNOSYM(sortby),KNO_VOID);
+  if (! ((KNO_VOIDP(sortby)) || (KNO_FALSEP(sortby))) ) {
+    lispval sortmem = kno_getopt(opts,KNOSYM(sortmem),KNO_VOID);
+    lispval sortdir = kno_getopt(opts,KNOSYM(sortdir),KNO_VOID);
+    result->rs_sort = make_sort(sortby,sortmem,sortdir);
+    kno_decref(sortmem);
+    kno_decref(sortdir);
+    if (result->rs_sort == NULL) {
+      kno_decref(sortby);
+      kno_decref((lispval)result);
+      return NULL;}}
+  kno_decref(sortby);
+
+  lispval sparse = kno_getopt(opts,KNOSYM(sparse),KNO_FALSE);
+  if (KNO_TRUEP(sparse))
+    result->rs_sparse_threshold = 2.0;
+  else if (KNO_FLONUMP(sparse))
+    result->rs_sparse_threshold = KNO_FLONUM(sparse);
+  else if (KNO_FIXNUMP(sparse))
+    result->rs_sparse_threshold = KNO_FIX2INT(sparse);
+  else NO_ELSE;
+  if (result->rs_sparse_threshold > 0)
+    result->rs_bits |= KNO_READSTAT_SPARSE;
+  kno_decref(sparse);
+
+  lispval dates = kno_getopt(opts,KNOSYM(dates),KNO_FALSE);
+  if (dates == KNOSYM(epoch))
+    result->rs_dates = READSTAT_DATES_EPOCH;
+  else if (!(KNO_FALSEP(dates)))
+    result->rs_dates = READSTAT_DATES_TIMESTAMP;
+  else NO_ELSE;
+  kno_decref(dates);
 
   lispval foldcase = (kno_getopt(opts,KNOSYM(foldcase),KNO_TRUE));
   if (KNO_TRUEP(foldcase))
@@ -545,7 +2037,7 @@ static void add_value_label(kno_readstat rs,
   if (KNO_VOIDP(label_set)) {
     label_set=kno_make_slotmap(16,0,NULL);
     kno_store(labels,label_set_name,label_set);}
-  lispval label_string = knostring(label);
+  lispval label_string = readstat_text(rs,label);
   kno_store(label_set,label_string,v);
   kno_decref(label_string);
   kno_decref(label_set_name);
@@ -557,12 +2049,23 @@ static void recycle_readstat(struct KNO_RAW_CONS *c)
   struct KNO_READSTAT *rs = (struct KNO_READSTAT *)c;
   readstat_parser_free(rs->rs_parser); rs->rs_parser=NULL;
   if (rs->rs_source) { u8_free(rs->rs_source); rs->rs_source=NULL; }
+  u8_close_output(&(rs->rs_textbuf));
   kno_decref(rs->annotations);
   kno_decref(rs->rs_vlabels);
   if (rs->rs_observation) {
     kno_decref(((lispval)rs->rs_observation));}
   kno_decref((lispval)(rs->rs_observation));
   kno_decref(rs->rs_output);
+  kno_decref(rs->rs_shards);
+  kno_decref(rs->rs_shardkey);
+  free_indexes(rs);
+  if (rs->rs_sort) { free_sort(rs->rs_sort); rs->rs_sort = NULL; }
+  if (rs->rs_datekinds) u8_free(rs->rs_datekinds);
+  if (rs->rs_scratch) {
+    clear_sparse_cells(rs);
+    u8_free(rs->rs_scratch);
+    u8_free(rs->rs_present);
+    u8_free(rs->rs_keyvals);}
   if (!(KNO_STATIC_CONSP(c))) u8_free(c);
 }
 
@@ -614,12 +2117,26 @@ static lispval readstat_type(lispval arg)
 
 DEFC_PRIM("readstat-output",readstat_output,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "Gets the output of the readstat object",
+	  "Gets the output of the readstat object. When the object was "
+	  "created with `shards` (which can't be combined with `output`), "
+	  "this returns a vector of the shard outputs.",
 	  {"rs",KNO_READSTAT_TYPE,KNO_VOID})
 static lispval readstat_output(lispval arg)
 {
   kno_readstat rs = (kno_readstat) arg;
-  return kno_simplify_choice(rs->rs_output);
+  if (rs->rs_n_shards > 0) {
+    int i = 0, n = rs->rs_n_shards;
+    lispval *sinks = KNO_VECTOR_ELTS(rs->rs_shards);
+    lispval result = kno_make_vector(n,NULL);
+    while (i<n) {
+      lispval sink = sinks[i];
+      if (KNO_PRECHOICEP(sink))
+	sink = kno_simplify_choice(sink);
+      else kno_incref(sink);
+      KNO_VECTOR_SET(result,i,sink);
+      i++;}
+    return result;}
+  else return kno_simplify_choice(rs->rs_output);
 }
 
 DEFC_PRIM("readstat-count",readstat_count,
@@ -642,28 +2159,179 @@ static lispval readstat_labels(lispval arg)
   return kno_incref(rs->rs_vlabels);
 }
 
+static void store_hash(lispval table,lispval slotid,unsigned long long h)
+{
+  char buf[32];
+  snprintf(buf,sizeof(buf),"%llx",h);
+  store_string(table,slotid,buf);
+}
+
+DEFC_PRIM("readstat-checkpoint",readstat_checkpoint,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Gets a checkpoint for the rows loaded by the readstat object, "
+	  "which can be passed as the `since` option to a later load "
+	  "to only read rows appended since then",
+	  {"rs",KNO_READSTAT_TYPE,KNO_VOID})
+static lispval readstat_checkpoint(lispval arg)
+{
+  kno_readstat rs = (kno_readstat) arg;
+  lispval checkpoint = kno_make_slotmap(4,0,NULL);
+  if (rs->rs_source)
+    store_string(checkpoint,KNOSYM(source),rs->rs_source);
+  kno_store(checkpoint,KNOSYM(rows),KNO_INT(rs->rs_last_row+1));
+  store_hash(checkpoint,KNOSYM(schema),rs->rs_schema_hash);
+  store_hash(checkpoint,KNOSYM(lastrow),rs->rs_last_hash);
+  return checkpoint;
+}
+
+DEFC_PRIM("readstat-lookup",readstat_lookup,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Gets the observations whose *slot* is *key*, using an index "
+	  "built with the `index` option. *slot* defaults to the first "
+	  "indexed slot.",
+	  {"rs",KNO_READSTAT_TYPE,KNO_VOID},
+	  {"key",kno_any_type,KNO_VOID},
+	  {"slot",kno_symbol_type,KNO_VOID})
+static lispval readstat_lookup(lispval arg,lispval key,lispval slot)
+{
+  kno_readstat rs = (kno_readstat) arg;
+  int i = 0, n = rs->rs_n_indexes;
+  while (i<n) {
+    struct KNO_READSTAT_INDEX *ix = &(rs->rs_indexes[i]);
+    if ( (KNO_VOIDP(slot)) || (ix->rsx_slotid == slot) )
+      return index_lookup(ix,key);
+    else i++;}
+  return kno_err("ReadStatNoIndex","readstat_lookup",rs->rs_source,slot);
+}
+
 /* Readstat openers */
 
-DEFC_PRIM("readstat/load/dta",readstat_dta,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
-	  "Opens a Stata .dta file",
-	  {"path",kno_string_type,KNO_VOID},
-	  {"opts",kno_opts_type,KNO_FALSE})
-static lispval readstat_dta(lispval path,lispval opts)
+typedef readstat_error_t (*readstat_parsefn)
+  (readstat_parser_t *parser,const char *path,void *state);
+
+static unsigned long long get_checkpoint_hash(lispval checkpoint,lispval slot)
+{
+  lispval v = kno_get(checkpoint,slot,KNO_VOID);
+  unsigned long long h = (KNO_STRINGP(v)) ?
+    (strtoull(KNO_CSTRING(v),NULL,16)) : (0);
+  kno_decref(v);
+  return h;
+}
+
+/* This sets up the readstat object to resume after a previous load
+   described by *checkpoint*. The parse starts at the last row of the
+   previous load, which is checked against the checkpoint and then
+   dropped (see finish_observation()). */
+static int setup_resume(kno_readstat rs,lispval checkpoint)
+{
+  if (! ( (KNO_SLOTMAPP(checkpoint)) || (KNO_SCHEMAPP(checkpoint)) ) )
+    return 0;
+  lispval source = kno_get(checkpoint,KNOSYM(source),KNO_VOID);
+  int same_source = (KNO_STRINGP(source)) && (rs->rs_source) &&
+    (strcmp(KNO_CSTRING(source),rs->rs_source) == 0);
+  kno_decref(source);
+  if (!(same_source)) {
+    u8_log(LOGNOTICE,"ReadStatReload",
+	   "Checkpoint isn't for %s, loading all rows",rs->rs_source);
+    return 0;}
+  lispval rows = kno_get(checkpoint,KNOSYM(rows),KNO_VOID);
+  long long n_rows = (KNO_FIXNUMP(rows)) ? (KNO_FIX2INT(rows)) : (-1);
+  kno_decref(rows);
+  if (n_rows <= 0) return 0;
+  rs->rs_since_schema = get_checkpoint_hash(checkpoint,KNOSYM(schema));
+  rs->rs_since_row    = get_checkpoint_hash(checkpoint,KNOSYM(lastrow));
+  if (readstat_set_row_offset(rs->rs_parser,n_rows-1) != READSTAT_OK)
+    return 0;
+  rs->rs_row_offset = n_rows-1;
+  rs->rs_bits |= KNO_READSTAT_RESUMING;
+  return 1;
+}
+
+/* This resets the readstat object for a full reload from the first row */
+static void reset_readstat(kno_readstat rs)
+{
+  if (rs->rs_observation) {
+    kno_decref(((lispval)rs->rs_observation));
+    rs->rs_observation = NULL;}
+  if (rs->rs_dataframe) {
+    kno_decref(((lispval)rs->rs_dataframe));
+    rs->rs_dataframe = NULL;}
+  rs->rs_bits &= ~(KNO_READSTAT_RESUMING|KNO_READSTAT_STALE|
+		   KNO_READSTAT_DENSE);
+  rs->rs_obsid = -1;
+  rs->rs_counter = 0;
+  rs->rs_shardslot = -1;
+  int i = 0; while (i<rs->rs_n_indexes) rs->rs_indexes[i++].rsx_slotno = -1;
+  if (rs->rs_sort) rs->rs_sort->sort_slotnos[0] = -1;
+  if (rs->rs_scratch) clear_sparse_cells(rs);
+  rs->rs_values = NULL;
+  rs->rs_cells_present = 0;
+  rs->rs_cells_total = 0;
+  rs->rs_row_offset = 0;
+  rs->rs_last_row = -1;
+  rs->rs_schema_hash = 0;
+  rs->rs_last_hash = 0;
+  readstat_set_row_offset(rs->rs_parser,0);
+}
+
+/* This finishes the row pending when the parse is done, which is the
+   last row of the file and is recorded for checkpoints */
+static void finish_last_observation(kno_readstat rs)
+{
+  if ( (rs->rs_obsid >= 0) && (rs->rs_values) )
+    rs->rs_last_hash = hash_row(rs);
+  finish_observation(rs);
+}
+
+static lispval readstat_load(lispval path,lispval opts,u8_context type,
+			     readstat_parsefn parse,u8_context caller)
 {
   kno_readstat rs = create_readstat(opts);
-  if (rs) rs->rs_type="dta"; else return KNO_ERROR;
+  if (rs) rs->rs_type=type; else return KNO_ERROR;
   rs->rs_source = u8_strdup(KNO_CSTRING(path));
-  readstat_error_t rv = readstat_parse_dta(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
-  if (rv == READSTAT_HANDLER_OK)
+  lispval since = kno_getopt(opts,KNOSYM(since),KNO_VOID);
+  int resuming = setup_resume(rs,since);
+  kno_decref(since);
+  readstat_error_t rv = parse(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
+  if (rv == READSTAT_OK) finish_last_observation(rs);
+  if ((rs->rs_bits)&(KNO_READSTAT_FAILED)) {
+    kno_decref((lispval)rs);
+    return KNO_ERROR_VALUE;}
+  if ( (resuming) &&
+       ((rs->rs_bits)&(KNO_READSTAT_RESUMING|KNO_READSTAT_STALE)) ) {
+    u8_log(LOGNOTICE,"ReadStatReload",
+	   "Checkpoint doesn't match %s, reloading all rows",rs->rs_source);
+    reset_readstat(rs);
+    rv = parse(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
+    if (rv == READSTAT_OK) finish_last_observation(rs);
+    if ((rs->rs_bits)&(KNO_READSTAT_FAILED)) {
+      kno_decref((lispval)rs);
+      return KNO_ERROR_VALUE;}}
+  else if (resuming)
+    kno_store(rs->annotations,KNOSYM(resumed),KNO_INT(rs->rs_row_offset+1));
+  else NO_ELSE;
+  if ( (rv == READSTAT_OK) && (rs->rs_sort) && (finish_sort(rs)<0) ) {
+    kno_decref((lispval)rs);
+    return KNO_ERROR_VALUE;}
+  if (rv == READSTAT_OK)
     return (lispval) rs;
   else {
     lispval rsv = (lispval) rs;
-    kno_seterr("ReadStatError","readstat/load/dta",readstat_error_message(rv),path);
+    kno_seterr("ReadStatError",caller,readstat_error_message(rv),path);
     kno_decref(rsv);
     return KNO_ERROR_VALUE;}
 }
 
+DEFC_PRIM("readstat/load/dta",readstat_dta,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Opens a Stata .dta file",
+	  {"path",kno_string_type,KNO_VOID},
+	  {"opts",kno_opts_type,KNO_FALSE})
+static lispval readstat_dta(lispval path,lispval opts)
+{
+  return readstat_load(path,opts,"dta",readstat_parse_dta,"readstat/load/dta");
+}
+
 DEFC_PRIM("readstat/load/sav",readstat_sav,
 	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
 	  "Opens a Stata .sav file",
@@ -671,17 +2339,7 @@ DEFC_PRIM("readstat/load/sav",readstat_sav,
 	  {"opts",kno_opts_type,KNO_FALSE})
 static lispval readstat_sav(lispval path,lispval opts)
 {
-  kno_readstat rs = create_readstat(opts);
-  if (rs) rs->rs_type="sav"; else return KNO_ERROR;
-  rs->rs_source = u8_strdup(KNO_CSTRING(path));
-  readstat_error_t rv = readstat_parse_sav(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
-  if (rv == READSTAT_HANDLER_OK)
-    return (lispval) rs;
-  else {
-    lispval rsv = (lispval) rs;
-    kno_seterr("ReadStatError","readstat/load/sav",readstat_error_message(rv),path);
-    kno_decref(rsv);
-    return KNO_ERROR_VALUE;}
+  return readstat_load(path,opts,"sav",readstat_parse_sav,"readstat/load/sav");
 }
 
 DEFC_PRIM("readstat/load/por",readstat_por,
@@ -691,17 +2349,7 @@ DEFC_PRIM("readstat/load/por",readstat_por,
 	  {"opts",kno_opts_type,KNO_FALSE})
 static lispval readstat_por(lispval path,lispval opts)
 {
-  kno_readstat rs = create_readstat(opts);
-  if (rs) rs->rs_type="por"; else return KNO_ERROR;
-  rs->rs_source = u8_strdup(KNO_CSTRING(path));
-  readstat_error_t rv = readstat_parse_por(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
-  if (rv == READSTAT_HANDLER_OK)
-    return (lispval) rs;
-  else {
-    lispval rsv = (lispval) rs;
-    kno_seterr("ReadStatError","readstat/load/por",readstat_error_message(rv),path);
-    kno_decref(rsv);
-    return KNO_ERROR_VALUE;}
+  return readstat_load(path,opts,"por",readstat_parse_por,"readstat/load/por");
 }
 
 DEFC_PRIM("readstat/load/sas7bdat",readstat_sas7bdat,
@@ -711,17 +2359,8 @@ DEFC_PRIM("readstat/load/sas7bdat",readstat_sas7bdat,
 	  {"opts",kno_opts_type,KNO_FALSE})
 static lispval readstat_sas7bdat(lispval path,lispval opts)
 {
-  kno_readstat rs = create_readstat(opts);
-  if (rs) rs->rs_type="sas7bdat"; else return KNO_ERROR;
-  rs->rs_source = u8_strdup(KNO_CSTRING(path));
-  readstat_error_t rv = readstat_parse_sas7bdat(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
-  if (rv == READSTAT_HANDLER_OK)
-    return (lispval) rs;
-  else {
-    lispval rsv = (lispval) rs;
-    kno_seterr("ReadStatError","readstat/load/sas7bdat",readstat_error_message(rv),path);
-    kno_decref(rsv);
-    return KNO_ERROR_VALUE;}
+  return readstat_load(path,opts,"sas7bdat",readstat_parse_sas7bdat,
+		       "readstat/load/sas7bdat");
 }
 
 DEFC_PRIM("readstat/load/sas7bcat",readstat_sas7bcat,
@@ -731,17 +2370,8 @@ DEFC_PRIM("readstat/load/sas7bcat",readstat_sas7bcat,
 	  {"opts",kno_opts_type,KNO_FALSE})
 static lispval readstat_sas7bcat(lispval path,lispval opts)
 {
-  kno_readstat rs = create_readstat(opts);
-  if (rs) rs->rs_type="sas7bcat"; else return KNO_ERROR;
-  rs->rs_source = u8_strdup(KNO_CSTRING(path));
-  readstat_error_t rv = readstat_parse_sas7bcat(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
-  if (rv == READSTAT_HANDLER_OK)
-    return (lispval) rs;
-  else {
-    lispval rsv = (lispval) rs;
-    kno_seterr("ReadStatError","readstat/load/sas7bcat",readstat_error_message(rv),path);
-    kno_decref(rsv);
-    return KNO_ERROR_VALUE;}
+  return readstat_load(path,opts,"sas7bcat",readstat_parse_sas7bcat,
+		       "readstat/load/sas7bcat");
 }
 
 DEFC_PRIM("readstat/load/xport",readstat_xport,
@@ -751,17 +2381,8 @@ DEFC_PRIM("readstat/load/xport",readstat_xport,
 	  {"opts",kno_opts_type,KNO_FALSE})
 static lispval readstat_xport(lispval path,lispval opts)
 {
-  kno_readstat rs = create_readstat(opts);
-  if (rs) rs->rs_type="xport"; else return KNO_ERROR;
-  rs->rs_source = u8_strdup(KNO_CSTRING(path));
-  readstat_error_t rv = readstat_parse_xport(rs->rs_parser,KNO_CSTRING(path),(void *)rs);
-  if (rv == READSTAT_HANDLER_OK)
-    return (lispval) rs;
-  else {
-    lispval rsv = (lispval) rs;
-    kno_seterr("ReadStatError","readstat/load/xport",readstat_error_message(rv),path);
-    kno_decref(rsv);
-    return KNO_ERROR_VALUE;}
+  return readstat_load(path,opts,"xport",readstat_parse_xport,
+		       "readstat/load/xport");
 }
 
 static int readstat_initialized = 0;
@@ -810,4 +2431,6 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("readstat-labels",readstat_labels,1,creadstat_module);
   KNO_LINK_CPRIM("readstat-output",readstat_output,1,creadstat_module);
   KNO_LINK_CPRIM("readstat-count",readstat_count,1,creadstat_module);
+  KNO_LINK_CPRIM("readstat-checkpoint",readstat_checkpoint,1,creadstat_module);
+  KNO_LINK_CPRIM("readstat-lookup",readstat_lookup,3,creadstat_module);
 }
@@ -9,7 +9,7 @@
 
 (use-module '{texttools})
 
-(module-export! '{readstat/load})
+(module-export! '{readstat/load readstat/load-since})
 
 (define creadstat (get-module 'creadstat))
 
@@ -22,15 +22,23 @@
 	((has-suffix file ".xport") (readstat/load/xport file opts))
 	(else (error |Can't handle file type| file))))
 
+(define (readstat/load-since file checkpoint (opts #f))
+  (let ((since-opts (frame-create #f 'since checkpoint)))
+    (readstat/load file (if opts (cons since-opts opts) since-opts))))
+
 (define readstat-output (get creadstat 'readstat-output))
 (define readstat-labels (get creadstat 'readstat-labels))
 (define readstat-dataframe (get creadstat 'readstat-dataframe))
 (define readstat-source (get creadstat 'readstat-source))
 (define readstat-type (get creadstat 'readstat-type))
 (define readstat-count (get creadstat 'readstat-count))
+(define readstat-checkpoint (get creadstat 'readstat-checkpoint))
+(define readstat-lookup (get creadstat 'readstat-lookup))
 
 (module-export! '{readstat-source readstat-type
 		  readstat-labels
 		  readstat-dataframe
 		  readstat-count 
+		  readstat-checkpoint
+		  readstat-lookup
 		  readstat-output})